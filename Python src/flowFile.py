@@ -0,0 +1,44 @@
+# Reads flow files written by DenseFlow --flow, see src/flowFile.cpp for the layout. Only raw frames, compact
+# ones (--flowstep) are decoded by FlowFileReader.
+# The file is memory-mapped, a frame is read from disk only when its array is used.
+import mmap
+import struct
+import numpy as np
+
+
+class FlowFile:
+    def __init__(self, path):
+        self.file = open(path, "rb")
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, recordAlign, width, height, frames, indexOffset = struct.unpack_from("<8sIIiiQQ", self.map, 0)
+        if magic != b"DFLOWSEQ" or version != 2:
+            raise ValueError(path + " is not a flow file")
+        if indexOffset != 0:
+            if indexOffset + frames * 8 > len(self.map):
+                raise ValueError(path + " has a damaged index")
+            self.index = list(struct.unpack_from("<%dQ" % frames, self.map, indexOffset))
+            for offset in self.index:
+                if offset + 64 > len(self.map) or offset + 64 + struct.unpack_from("<Q", self.map, offset + 24)[0] > len(self.map):
+                    raise ValueError(path + " has a damaged index")
+        else:
+            # the writer did not finish, walk the records
+            self.index = []
+            offset = recordAlign
+            while offset + 64 <= len(self.map):
+                magic, encoding, frame, width, height, payloadBytes = struct.unpack_from("<4sIQiiQ", self.map, offset)
+                if magic != b"FRME" or offset + 64 + payloadBytes > len(self.map):
+                    break
+                self.index.append(offset)
+                offset += (64 + payloadBytes + recordAlign - 1) // recordAlign * recordAlign
+
+    def __len__(self):
+        return len(self.index)
+
+    # flow of frame n, a height x width x 2 float32 array over the file
+    def __getitem__(self, n):
+        magic, encoding, frame, width, height, payloadBytes = struct.unpack_from("<4sIQiiQ", self.map, self.index[n])
+        if encoding != 0:
+            raise ValueError("frame %d is not raw flow" % n)
+        if width <= 0 or height <= 0 or width * height * 8 > payloadBytes:
+            raise ValueError("frame %d is damaged" % n)
+        return np.frombuffer(self.map, np.float32, width * height * 2, self.index[n] + 64).reshape(height, width, 2)
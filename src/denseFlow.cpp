@@ -2,8 +2,20 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include "optflowgf.cpp"
+#include "flowFile.cpp"
+#include <opencv2/videoio.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <tbb/concurrent_queue.h>
 #include <filesystem>
+#include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <climits>
+#include <map>
 
 using namespace cv;
 using namespace std;
@@ -15,61 +27,1109 @@ namespace fs = std::filesystem;
 #define VIDEO "sample/vtest_000/vtest_%03d.png"
 #endif
 
-int main()
+static const char* keys =
+    "{help h   |                | print this message}"
+    "{input i  | " VIDEO " | frames to read, a printf pattern of image files or a video file}"
+    "{output o |                | writes the colourised flow to a printf pattern of image files or a video file}"
+    "{flow     |                | writes the flow of every pair to a flow file, or to a printf pattern of Middlebury .flo files}"
+    "{flowstep | 0              | stores the flow file quantised to steps of this many pixels and compressed; 0 stores raw float flow}"
+    "{gaussian |                | weights the flow update with a Gaussian window instead of a box filter}"
+    "{headless |                | no window and no wait between frames, for timing on hosts without a display}"
+    "{warmup   | 0              | frames at the start that are left out of the summary}"
+    "{budget   | 0              | time per frame in ms, every frame runs the best quality tier that fits; 0 always runs the full quality}"
+    "{repeat   | 1              | times the sequence is run, the flow starts over every time}"
+    "{pipeline |                | runs decoding, grayscale conversion, flow, colourisation and the sink as concurrent stages}"
+    "{queue    | 4              | frames each queue between two pipeline stages holds}"
+    "{readahead | 4             | frames of a printf pattern decoded ahead in parallel, straight to grayscale; 0 reads through VideoCapture}";
+
+//command line options, see keys
+struct Options
+{
+    string input, output, flow;
+    bool headless = false, gaussian = false;
+    int warmup = 0, repeat = 1, queue = 4, readAhead = 4;
+    double flowStep = 0, budget = 0;
+};
+
+static double msBetween(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+{
+    return chrono::duration_cast<chrono::duration<double, milli>>(end - start).count();
+}
+
+//nearest-rank percentile p (0-100) of the sorted samples
+static double percentile(const vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)std::ceil(p/100*sorted.size());
+    return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+static void printLatency(const char* name, vector<double> ms)
+{
+    std::sort(ms.begin(), ms.end());
+    cout << name << " latency: p50 " << percentile(ms, 50) << " ms, p90 " << percentile(ms, 90) << " ms, p99 "
+         << percentile(ms, 99) << " ms, max " << percentile(ms, 100) << " ms" << endl;
+}
+
+//frame buffers the consumer gave back, for the decoder to reuse; thread safe
+class FramePool
+{
+public:
+    explicit FramePool(size_t capacity) : capacity_(capacity) {}
+
+    //takes the buffer of frame, which must not be referenced anywhere else any more
+    void put(Mat& frame)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!frame.empty() && frames_.size() < capacity_)
+            frames_.push_back(frame);
+        frame.release();
+    }
+
+    //a buffer given back earlier, or an empty Mat
+    Mat take()
+    {
+        lock_guard<mutex> lock(mutex_);
+        Mat frame;
+        if (!frames_.empty()){
+            frame = frames_.back();
+            frames_.pop_back();
+        }
+        return frame;
+    }
+
+private:
+    size_t capacity_;
+    vector<Mat> frames_;
+    mutex mutex_;
+};
+
+//Reads a numbered image sequence (a printf pattern, starting at index 0 or 1) ahead of the consumer. Worker
+//threads decode the next depth files in parallel, straight to grayscale where the codec supports it, into a
+//ring of depth slots; read hands the frames out in order. The frames are decoded into the buffers of pool, so
+//once the consumer gives its frames back there no frame buffer is allocated.
+class SequenceReader
+{
+public:
+    SequenceReader(const string& pattern, int depth, FramePool& pool)
+        : pattern_(pattern), slots_(std::max(depth, 1)), pool_(pool)
+    {
+        for (int first = 0; first <= 1 && !opened_; first++){
+            opened_ = std::ifstream(format(pattern_.c_str(), first)).good();
+            next_ = delivered_ = first;
+        }
+        if (!opened_)
+            return;
+        int workers = std::min((int)slots_.size(), std::max((int)thread::hardware_concurrency(), 1));
+        for (int i = 0; i < workers; i++)
+            workers_.emplace_back([this]{ work(); });
+    }
+
+    ~SequenceReader()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stop_ = true;
+        }
+        workCv_.notify_all();
+        for (thread& worker : workers_)
+            worker.join();
+    }
+
+    bool isOpened() const { return opened_; }
+
+    //next frame of the sequence, false after the last one (the first missing or undecodable file)
+    bool read(Mat& gray)
+    {
+        unique_lock<mutex> lock(mutex_);
+        Slot& slot = slots_[delivered_ % slots_.size()];
+        readyCv_.wait(lock, [&]{ return delivered_ >= end_ || (slot.ready && slot.index == delivered_); });
+        if (delivered_ >= end_)
+            return false;
+        gray = slot.gray;
+        slot.gray = Mat();
+        slot.ready = false;
+        delivered_++;
+        workCv_.notify_all();
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        Mat gray;
+        //the encoded file, kept so that its buffer is reused
+        vector<uchar> bytes;
+        int index = -1;
+        bool ready = false;
+    };
+
+    void work()
+    {
+        unique_lock<mutex> lock(mutex_);
+        while (true){
+            //at most depth frames ahead of the consumer, so a slot is only reused once it was read
+            workCv_.wait(lock, [&]{ return stop_ || (next_ < end_ && next_ < delivered_ + (int)slots_.size()); });
+            if (stop_)
+                return;
+            int index = next_++;
+            Slot& slot = slots_[index % slots_.size()];
+            lock.unlock();
+            Mat gray = pool_.take();
+            bool decoded = decode(index, slot.bytes, gray);
+            lock.lock();
+            slot.gray = gray;
+            slot.index = index;
+            slot.ready = true;
+            if (!decoded)
+                end_ = std::min(end_, index);
+            readyCv_.notify_all();
+        }
+    }
+
+    bool decode(int index, vector<uchar>& bytes, Mat& gray) const
+    {
+        std::ifstream file(format(pattern_.c_str(), index), std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        bytes.resize((size_t)file.tellg());
+        file.seekg(0);
+        if (!file.read((char*)bytes.data(), bytes.size()))
+            return false;
+        //decodes into gray when it already has the size and type of the image
+        imdecode(bytes, IMREAD_GRAYSCALE, &gray);
+        return !gray.empty();
+    }
+
+    string pattern_;
+    vector<Slot> slots_;
+    FramePool& pool_;
+    vector<thread> workers_;
+    mutex mutex_;
+    condition_variable workCv_, readyCv_;
+    //next index a worker decodes, next index read hands out and the first index past the sequence
+    int next_ = 0, delivered_ = 0, end_ = INT_MAX;
+    bool opened_ = false, stop_ = false;
+};
+
+//Frames of the input: a SequenceReader for printf patterns with read-ahead, which gives grayscale frames, else
+//VideoCapture, which gives BGR frames.
+class FrameSource
+{
+public:
+    explicit FrameSource(const Options& options)
+        : options_(options), sequence_(options.readAhead > 0 && options.input.find('%') != string::npos),
+          pool_(options.readAhead + 2) {}
+
+    //(re)starts the input at its first frame
+    bool open()
+    {
+        reader_.reset();
+        if (sequence_){
+            reader_.reset(new SequenceReader(options_.input, options_.readAhead, pool_));
+            return reader_->isOpened();
+        }
+        return capture_.open(options_.input);
+    }
+
+    bool read(Mat& image)
+    {
+        if (reader_)
+            return reader_->read(image);
+        capture_ >> image;
+        return !image.empty();
+    }
+
+    //gives back a grayscale frame that is not referenced anywhere else any more, from any thread
+    void recycle(Mat& gray)
+    {
+        if (sequence_)
+            pool_.put(gray);
+        else
+            gray.release();
+    }
+
+    double fps() const { return reader_ ? 0 : capture_.get(CAP_PROP_FPS); }
+
+private:
+    const Options& options_;
+    bool sequence_;
+    FramePool pool_;
+    unique_ptr<SequenceReader> reader_;
+    VideoCapture capture_;
+};
+
+//grayscale image of a decoded frame, the frame itself if the source already decoded it to grayscale
+static void toGray(const Mat& image, Mat& gray)
+{
+    if (image.channels() == 1)
+        gray = image;
+    else
+        cvtColor(image, gray, COLOR_BGR2GRAY);
+}
+
+//latency of the frames after the warm-up, from reading a frame to handing its colour image to the sink, and of
+//its flow alone
+struct FrameTimes
+{
+    explicit FrameTimes(int warmup) : warmup(warmup), measureStart(chrono::steady_clock::now()) {}
+
+    void add(double ms, double flowMs)
+    {
+        if (frames >= warmup){
+            frameMs.push_back(ms);
+            this->flowMs.push_back(flowMs);
+        }
+        if (++frames == warmup)
+            measureStart = chrono::steady_clock::now();
+    }
+
+    void print(bool headless) const
+    {
+        if (frameMs.empty())
+            return;
+        double seconds = msBetween(measureStart, chrono::steady_clock::now())/1000;
+        cout << frameMs.size() << " frames after " << std::min(frames, warmup) << " warm-up frames: "
+             << frameMs.size()/seconds << " fps" << (headless ? "" : " (with display and waitKey)") << endl;
+        printLatency("frame", frameMs);
+        printLatency("flow", flowMs);
+    }
+
+    int warmup, frames = 0;
+    chrono::steady_clock::time_point measureStart;
+    vector<double> frameMs, flowMs;
+};
+
+//quality tiers the frame budget chose, per tier over the frames after the warm-up
+struct TierTimes
+{
+    explicit TierTimes(int warmup) : warmup(warmup) {}
+
+    void add(const FarnebackFrameTier& tier)
+    {
+        if (frames++ >= warmup)
+            this->tier.push_back(tier);
+    }
+
+    void print(double budgetMs) const
+    {
+        map<int, vector<FarnebackFrameTier> > byTier;
+        for (const FarnebackFrameTier& t : tier)
+            byTier[t.tier].push_back(t);
+        for (const auto& entry : byTier){
+            const FarnebackFrameTier& t = entry.second.front();
+            double sum = 0, maxMs = 0;
+            int over = 0;
+            for (const FarnebackFrameTier& f : entry.second){
+                sum += f.ms;
+                maxMs = std::max(maxMs, f.ms);
+                over += f.ms > budgetMs;
+            }
+            cout << "tier " << entry.first << " (levels " << t.finest << "-" << t.top << ", " << t.iterations
+                 << " iterations): " << entry.second.size() << " frames, mean " << sum/entry.second.size()
+                 << " ms, max " << maxMs << " ms, " << over << " over the budget of " << budgetMs << " ms" << endl;
+        }
+    }
+
+    int warmup, frames = 0;
+    vector<FarnebackFrameTier> tier;
+};
+
+//Colour image of the flow: the hue is the direction and the value the magnitude relative to the largest one of
+//the previous frame, saturating above it. The first frame finds its own largest magnitude in a first pass.
+//Every pixel is converted in one parallel pass straight from the flow to BGR: the saturation is full, so the
+//HSV to BGR conversion is linear in the value and the colour of each 8 bit hue at full value comes from a table.
+class FlowColouriser
+{
+public:
+    FlowColouriser()
+    {
+        //hue h is 2h degrees, as in 8 bit HSV; the last entry is 360 degrees, the same colour as 0
+        for (int h = 0; h <= 180; h++){
+            float sector = (h % 180)/30.f, f = sector - std::floor(sector);
+            const float rgb[6][3] = { { 1, f, 0 }, { 1 - f, 1, 0 }, { 0, 1, f }, { 0, 1 - f, 1 }, { f, 0, 1 }, { 1, 0, 1 - f } };
+            const float* c = rgb[(int)sector];
+            wheel_[h][0] = c[2];
+            wheel_[h][1] = c[1];
+            wheel_[h][2] = c[0];
+        }
+    }
+
+    void operator()(const Mat& flow, Mat& bgr)
+    {
+        CV_Assert(flow.type() == CV_32FC2);
+        bgr.create(flow.size(), CV_8UC3);
+        if (maxMagnitude_ <= 0)
+            FarnebackForEachBand(flow.rows, 8, [&](int y0, int y1){
+                float bandMax = 0;
+                for (int y = y0; y < y1; y++){
+                    const float* f = flow.ptr<float>(y);
+                    for (int x = 0; x < flow.cols; x++){
+                        float m = magnitude(f[x*2], f[x*2+1]);
+                        bandMax = std::max(bandMax, std::isfinite(m + f[x*2] + f[x*2+1]) ? m : 0.f);
+                    }
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                maxMagnitude_ = std::max(maxMagnitude_, bandMax);
+            });
+        float scale = maxMagnitude_ > 0 ? 255.f/maxMagnitude_ : 0.f;
+        float frameMax = 0;
+        FarnebackForEachBand(flow.rows, 8, [&](int y0, int y1){
+            //the arithmetic of a row runs in a branchless loop the compiler vectorises, the table lookups in a second one
+            thread_local vector<int> hue;
+            thread_local vector<float> value;
+            hue.resize(flow.cols);
+            value.resize(flow.cols);
+            float bandMax = 0;
+            for (int y = y0; y < y1; y++){
+                const float* f = flow.ptr<float>(y);
+                uchar* d = bgr.ptr<uchar>(y);
+                for (int x = 0; x < flow.cols; x++){
+                    float fx = f[x*2], fy = f[x*2+1], m = magnitude(fx, fy);
+                    //NaN or infinite flow (or a magnitude beyond the float range) is drawn black
+                    if (!std::isfinite(m + fx + fy))
+                        fx = fy = m = 0;
+                    bandMax = std::max(bandMax, m);
+                    value[x] = std::min(m*scale, 255.f);
+                    //at least 0, so adding 0.5 and truncating rounds
+                    hue[x] = (int)(angle(fx, fy)*0.5f + 0.5f);
+                }
+                for (int x = 0; x < flow.cols; x++, d += 3){
+                    const float* c = wheel_[hue[x]];
+                    d[0] = (uchar)(c[0]*value[x] + 0.5f);
+                    d[1] = (uchar)(c[1]*value[x] + 0.5f);
+                    d[2] = (uchar)(c[2]*value[x] + 0.5f);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            frameMax = std::max(frameMax, bandMax);
+        });
+        maxMagnitude_ = frameMax;
+    }
+
+private:
+    //alpha max plus beta min, within 4% of the length
+    static float magnitude(float x, float y)
+    {
+        float ax = std::abs(x), ay = std::abs(y);
+        return 0.96043387f*std::max(ax, ay) + 0.39782473f*std::min(ax, ay);
+    }
+
+    //direction in degrees [0, 360] from a polynomial for the arctangent of the smaller over the larger
+    //coordinate, within 0.01 degrees
+    static float angle(float x, float y)
+    {
+        const float p1 = 0.9997878412794807f*57.29577951f, p3 = -0.3258083974640975f*57.29577951f,
+                    p5 = 0.1555786518463281f*57.29577951f, p7 = -0.04432655554792128f*57.29577951f;
+        float ax = std::abs(x), ay = std::abs(y);
+        float c = std::min(ax, ay)/(std::max(ax, ay) + FLT_EPSILON), c2 = c*c;
+        float a = (((p7*c2 + p5)*c2 + p3)*c2 + p1)*c;
+        a = ay > ax ? 90.f - a : a;
+        a = x < 0 ? 180.f - a : a;
+        return y < 0 ? 360.f - a : a;
+    }
+
+    float wheel_[181][3];
+    //largest magnitude of the previous frame, 0 before the first one
+    float maxMagnitude_ = 0;
+    std::mutex mutex_;
+};
+
+//where the colour images go: a window unless headless, and the output if one is given
+class FrameSink
+{
+public:
+    FrameSink(const Options& options, double fps) : options_(options), fps_(fps > 0 ? fps : 30) {}
+
+    //false if the output cannot be opened
+    bool write(const Mat& bgr)
+    {
+        if (!options_.output.empty()){
+            if (!writer_.isOpened()){
+                //a printf pattern is written as numbered images, anything else as a video
+                if (options_.output.find('%') != string::npos)
+                    writer_.open(options_.output, CAP_IMAGES, 0, 0, bgr.size());
+                else
+                    writer_.open(options_.output, VideoWriter::fourcc('M', 'J', 'P', 'G'), fps_, bgr.size());
+                if (!writer_.isOpened()){
+                    cerr << "Unable to open output " << options_.output << endl;
+                    return false;
+                }
+            }
+            writer_.write(bgr);
+        }
+        if (!options_.headless)
+            imshow("frame2", bgr);
+        return true;
+    }
+
+    //waits for a key unless headless, false once q or escape was pressed
+    bool next()
+    {
+        if (options_.headless)
+            return true;
+        int keyboard = waitKey(30);
+        return keyboard != 'q' && keyboard != 27;
+    }
+
+private:
+    const Options& options_;
+    double fps_;
+    VideoWriter writer_;
+};
+
+//where the flow of every pair goes besides its colour image: a flow file, numbered .flo files or nowhere
+class FlowSink
 {
+public:
+    explicit FlowSink(const Options& options) : path_(options.flow)
+    {
+        params_.step = options.flowStep;
+    }
+
+    //false if the flow file cannot be created
+    bool open()
+    {
+        if (path_.empty() || path_.find('%') != string::npos)
+            return true;
+        if (!file_.open(path_, params_)){
+            cerr << "Unable to open flow file " << path_ << endl;
+            return false;
+        }
+        return true;
+    }
+
+    //With a raw flow file flow becomes a view of the next frame in the file, so the flow is computed straight
+    //into the file, and true is returned. Otherwise flow is left alone.
+    bool begin(Size size, Mat& flow)
+    {
+        if (!mapsFlow())
+            return false;
+        flow = file_.beginFrame(size);
+        return true;
+    }
+
+    //the flow of the pair is final; a view of the flow file is released, any other Mat kept
+    bool end(Mat& flow)
+    {
+        bool ok = true;
+        if (mapsFlow())
+            ok = file_.commitFrame(flow);
+        else if (file_.isOpened())
+            ok = file_.writeFrame(flow);
+        else if (!path_.empty())
+            ok = writeFlo(format(path_.c_str(), frames_), flow);
+        frames_++;
+        if (!ok)
+            cerr << "Unable to write the flow of frame " << frames_ - 1 << " to " << path_ << endl;
+        return ok;
+    }
+
+    //true if flows are views of a flow file
+    bool mapsFlow() const { return file_.isOpened() && !file_.isCompact(); }
+
+    //completes the flow file and prints how large it is against raw flow and how fast it was encoded
+    bool close()
+    {
+        if (!file_.isOpened())
+            return true;
+        FlowFileStats stats = file_.getStats();
+        if (!file_.close()){
+            cerr << "Unable to complete flow file " << path_ << endl;
+            return false;
+        }
+        cout << "flow file: " << stats.frames << " frames, " << stats.fileBytes/(1 << 20) << " MB, "
+             << stats.rawBytes/std::max(stats.fileBytes, 1.0) << ":1 against raw flow";
+        if (file_.isCompact())
+            cout << ", encoded at " << stats.rawBytes/(1 << 20)/std::max(stats.encodeMs/1000, 1e-9)
+                 << " MB/s, max error " << stats.maxError << " px";
+        cout << endl;
+        return true;
+    }
+
+private:
+    string path_;
+    FlowFileParams params_;
+    FlowFileWriter file_;
+    int frames_ = 0;
+};
+
+//Bounded queue between two pipeline stages. A full queue blocks the stage in front of it, so a slow stage holds
+//back all earlier ones instead of letting frames pile up. Records how full the queue was and how long both
+//sides waited.
+template<typename T> class StageQueue
+{
+public:
+    explicit StageQueue(int capacity) { queue_.set_capacity(capacity); }
+
+    void push(const T& item)
+    {
+        if (!queue_.try_push(item)){
+            auto start = chrono::steady_clock::now();
+            queue_.push(item);
+            fullMs_ += msBetween(start, chrono::steady_clock::now());
+        }
+        int depth = std::max((int)queue_.size(), 0);
+        depthSum_ += depth;
+        maxDepth_ = std::max(maxDepth_, depth);
+        pushes_++;
+    }
+
+    T pop()
+    {
+        T item;
+        if (!queue_.try_pop(item)){
+            auto start = chrono::steady_clock::now();
+            queue_.pop(item);
+            emptyMs_ += msBetween(start, chrono::steady_clock::now());
+        }
+        return item;
+    }
+
+    void report(const char* name) const
+    {
+        cout << name << " queue: mean depth " << (pushes_ > 0 ? depthSum_/pushes_ : 0) << ", max depth " << maxDepth_
+             << ", producer blocked " << fullMs_ << " ms, consumer waited " << emptyMs_ << " ms" << endl;
+    }
+
+private:
+    tbb::concurrent_bounded_queue<T> queue_;
+    //written by the producer
+    double fullMs_ = 0, depthSum_ = 0;
+    int maxDepth_ = 0;
+    long pushes_ = 0;
+    //written by the consumer
+    double emptyMs_ = 0;
+};
+
+//one frame on its way through the pipeline
+struct PipelineFrame
+{
+    //the decoded frame, then its grayscale image, then the colour image of its flow
+    Mat image;
+    Mat flow;
+    chrono::steady_clock::time_point start;
+    double flowMs = 0;
+    //the first frame of a run only fills the flow stream, the end marker follows the last frame
+    bool first = false;
+    bool end = false;
+};
+
+//Runs decoding, grayscale conversion, flow and colourisation in threads of their own and the sink in this one,
+//connected by queues of options.queue frames. While the flow of one frame is computed the next frames are
+//decoded and the previous ones colourised and written.
+static int runPipeline(FrameSource& source, const Ptr<CustomOpticalFlowImpl>& optflow, const Options& options)
+{
+    enum { DECODE = 0, GRAY = 1, FLOW = 2, COLOUR = 3, SINK = 4, STAGES = 5 };
+    const char* stageNames[STAGES] = { "decode", "gray", "flow", "colour", "sink" };
+    StageQueue<PipelineFrame> decoded(options.queue), grays(options.queue), flows(options.queue), colours(options.queue);
+    //flow Mats go from the flow stage to the sink and back, so they are not reallocated for every frame; with a
+    //flow file every frame gets a view of the file instead
+    tbb::concurrent_bounded_queue<Mat> flowPool;
+    for (int i = 0; i < 2*options.queue + 3; i++)
+        flowPool.push(Mat());
+    //set by the sink on quit, the stages then run dry
+    atomic<bool> stop(false);
+    //time every stage spent working and the frames it handled, each written by its own stage only
+    double busyMs[STAGES] = {};
+    int handled[STAGES] = {};
+    TierTimes tiers(options.warmup);
+    FrameSink sink(options, source.fps());
+    FlowSink flowSink(options);
+    if (!flowSink.open())
+        return 1;
+
+    thread decode([&]{
+        for (int run = 0; run < options.repeat && !stop; run++){
+            if (run > 0 && !source.open())
+                break;
+            for (bool first = true; !stop; first = false){
+                PipelineFrame frame;
+                frame.start = chrono::steady_clock::now();
+                if (!source.read(frame.image))
+                    break;
+                frame.first = first;
+                busyMs[DECODE] += msBetween(frame.start, chrono::steady_clock::now());
+                handled[DECODE]++;
+                decoded.push(frame);
+            }
+        }
+        PipelineFrame end;
+        end.end = true;
+        decoded.push(end);
+    });
+    thread gray([&]{
+        for (bool end = false; !end; ){
+            PipelineFrame frame = decoded.pop();
+            end = frame.end;
+            if (!end){
+                auto start = chrono::steady_clock::now();
+                Mat image;
+                toGray(frame.image, image);
+                frame.image = image;
+                busyMs[GRAY] += msBetween(start, chrono::steady_clock::now());
+                handled[GRAY]++;
+            }
+            grays.push(frame);
+        }
+    });
+    thread flow([&]{
+        for (bool end = false; !end; ){
+            PipelineFrame frame = grays.pop();
+            end = frame.end;
+            if (!end){
+                auto start = chrono::steady_clock::now();
+                if (frame.first){
+                    //a new run, its first frame is not paired with the last frame of the previous one
+                    optflow->resetStream();
+                    optflow->pushFrame(frame.image, noArray());
+                }
+                else{
+                    if (!flowSink.begin(frame.image.size(), frame.flow))
+                        flowPool.pop(frame.flow);
+                    optflow->pushFrame(frame.image, frame.flow);
+                    if (options.budget > 0)
+                        tiers.add(optflow->getFrameTier());
+                }
+                frame.flowMs = msBetween(start, chrono::steady_clock::now());
+                busyMs[FLOW] += frame.flowMs;
+                source.recycle(frame.image);
+                handled[FLOW]++;
+                if (frame.first)
+                    continue;
+            }
+            flows.push(frame);
+        }
+    });
+    thread colour([&]{
+        FlowColouriser colourise;
+        for (bool end = false; !end; ){
+            PipelineFrame frame = flows.pop();
+            end = frame.end;
+            if (!end){
+                auto start = chrono::steady_clock::now();
+                Mat bgr;
+                colourise(frame.flow, bgr);
+                frame.image = bgr;
+                busyMs[COLOUR] += msBetween(start, chrono::steady_clock::now());
+                handled[COLOUR]++;
+            }
+            colours.push(frame);
+        }
+    });
+
+    //the sink stays in the main thread, which owns the window
+    FrameTimes times(options.warmup);
+    int result = 0;
+    while (true){
+        PipelineFrame frame = colours.pop();
+        if (frame.end)
+            break;
+        if (!stop){
+            auto start = chrono::steady_clock::now();
+            if (!sink.write(frame.image) || !flowSink.end(frame.flow)){
+                result = 1;
+                stop = true;
+            }
+            else{
+                auto end = chrono::steady_clock::now();
+                busyMs[SINK] += msBetween(start, end);
+                handled[SINK]++;
+                times.add(msBetween(frame.start, end), frame.flowMs);
+                if (!sink.next())
+                    stop = true;
+            }
+        }
+        //the flow stage may be waiting for the Mat; a view of the flow file has been released by the flow sink,
+        //or is left to the flow sink after a stop
+        if (!frame.flow.empty() && !flowSink.mapsFlow())
+            flowPool.push(frame.flow);
+    }
+    decode.join();
+    gray.join();
+    flow.join();
+    colour.join();
+    if (!flowSink.close())
+        result = 1;
+
+    times.print(options.headless);
+    tiers.print(options.budget);
+    for (int i = 0; i < STAGES; i++)
+        cout << stageNames[i] << " stage: " << (handled[i] > 0 ? busyMs[i]/handled[i] : 0) << " ms per frame" << endl;
+    decoded.report("decode -> gray");
+    grays.report("gray -> flow");
+    flows.report("flow -> colour");
+    colours.report("colour -> sink");
+    return result;
+}
+
+#if defined(DENSEFLOW_REPORT_EPE) || defined(DENSEFLOW_REPORT_BATCH)
+//end-point error of flows against their reference flows over all pixels of all added pairs: mean, maximum and
+//percentiles, the latter from a histogram of 100 logarithmic bins per decade from 1e-6 px, so to about 2.3%
+struct EndPointError
+{
+    enum { BINS_PER_DECADE = 100, DECADES = 10 };
+
+    EndPointError() : bins(BINS_PER_DECADE*DECADES + 1) {}
+
+    void add(const Mat& flow, const Mat& ref)
+    {
+        for (int y = 0; y < flow.rows; y++){
+            const float* f = flow.ptr<float>(y);
+            const float* r = ref.ptr<float>(y);
+            for (int x = 0; x < flow.cols; x++){
+                double err = std::hypot(f[x*2] - r[x*2], f[x*2+1] - r[x*2+1]);
+                sum += err;
+                maxErr = std::max(maxErr, err);
+                //bin 0 holds everything below 1e-6 px, including exact matches
+                int bin = err < 1e-6 ? 0 : (int)((std::log10(err) + 6)*BINS_PER_DECADE) + 1;
+                bins[std::min(bin, (int)bins.size() - 1)]++;
+            }
+        }
+        count += flow.total();
+    }
+
+    double mean() const { return count ? sum/count : 0; }
+
+    //upper edge of the bin the percentile p (0-100) falls into, at most the maximum
+    double percentile(double p) const
+    {
+        double rank = p/100*count, seen = 0;
+        for (size_t i = 0; i < bins.size(); i++){
+            seen += bins[i];
+            if (seen >= rank && seen > 0)
+                return std::min(std::pow(10.0, (double)i/BINS_PER_DECADE - 6), maxErr);
+        }
+        return maxErr;
+    }
+
+    double sum = 0, maxErr = 0;
+    size_t count = 0;
+    vector<size_t> bins;
+};
+#endif
+
+#ifdef DENSEFLOW_REPORT_BOX_FILTER
+//time of one flow iteration with the double and with the float box filter alone, on the first pair of frames at
+//full resolution with interleaved and with planar FP32 coefficients; every iteration also updates the matrices
+static void reportBoxFilter(const Mat& frame0, const Mat& frame1)
+{
+    const int winSize = 15, iterations = 20;
+    Mat R[2];
+    for (int i = 0; i < 2; i++){
+        Mat img;
+        (i == 0 ? frame0 : frame1).convertTo(img, CV_32F);
+        FarnebackPolyExp(img, R[i], 5, 1.2);
+    }
+    for (int planar = 0; planar < 2; planar++){
+        Mat coeffs[2];
+        for (int i = 0; i < 2; i++)
+            FarnebackConvertStorage(R[i], coeffs[i], CV_32F, planar != 0);
+        double ms[2];
+        for (int method = 0; method < 2; method++){
+            Mat flow = Mat::zeros(frame0.size(), CV_32FC2), M;
+            FarnebackUpdateMatrices(coeffs[0], coeffs[1], flow, M, 0, flow.rows);
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++){
+                if (method == 0)
+                    FarnebackUpdateFlow_Blur(coeffs[0], coeffs[1], flow, M, winSize, true);
+                else
+                    FarnebackUpdateFlow_BlurFloat(coeffs[0], coeffs[1], flow, M, winSize, true);
+            }
+            ms[method] = msBetween(start, chrono::steady_clock::now())/iterations;
+        }
+        cout << "box filter, " << (planar ? "planar" : "interleaved") << ": double " << ms[0] << " ms, float "
+             << ms[1] << " ms per iteration (" << ms[0]/ms[1] << "x)" << endl;
+    }
+}
+#endif
+
+#ifdef DENSEFLOW_REPORT_FLOW_FILE
+//reads the flow file back: every frame in order, then a 64x64 region of the last frame on its own
+static void reportFlowFile(const string& path)
+{
+    FlowFileReader reader;
+    if (!reader.open(path) || reader.frames() == 0)
+        return;
+    Mat flow;
+    auto start = chrono::steady_clock::now();
+    for (int n = 0; n < reader.frames(); n++)
+        reader.read(n, flow);
+    double ms = msBetween(start, chrono::steady_clock::now());
+    double mb = (double)reader.frames()*flow.total()*flow.elemSize()/(1 << 20);
+    FlowFileReader region;
+    region.open(path);
+    start = chrono::steady_clock::now();
+    region.read(region.frames() - 1, flow, Rect(0, 0, 64, 64));
+    cout << "flow file decoding: " << mb/std::max(ms/1000, 1e-9) << " MB/s, " << ms/reader.frames()
+         << " ms per frame; a 64x64 region of the last frame alone: "
+         << msBetween(start, chrono::steady_clock::now()) << " ms" << endl;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    CommandLineParser parser(argc, argv, keys);
+    parser.about("Dense optical flow of consecutive frames, shown or written as a colour image");
+    if (parser.has("help")){
+        parser.printMessage();
+        return 0;
+    }
+    Options options;
+    options.input = (fs::current_path() / parser.get<string>("input")).generic_string();
+    options.output = parser.has("output") ? parser.get<string>("output") : string();
+    options.flow = parser.has("flow") ? parser.get<string>("flow") : string();
+    options.flowStep = std::max(parser.get<double>("flowstep"), 0.0);
+    options.headless = parser.has("headless");
+    options.gaussian = parser.has("gaussian");
+    options.warmup = std::max(parser.get<int>("warmup"), 0);
+    options.budget = std::max(parser.get<double>("budget"), 0.0);
+    options.repeat = std::max(parser.get<int>("repeat"), 1);
+    options.queue = std::max(parser.get<int>("queue"), 1);
+    options.readAhead = std::max(parser.get<int>("readahead"), 0);
+    bool pipeline = parser.has("pipeline");
+    if (!parser.check()){
+        parser.printErrors();
+        return 1;
+    }
+
     cout << "start optflow" << endl;
-    VideoCapture capture((fs::current_path() / VIDEO).generic_string());
+    FrameSource source(options);
 
-    if (!capture.isOpened()){
+    if (!source.open()){
         //error in opening the video input
         cerr << "Unable to open file!" << endl;
         return 0;
     }
+    //keep one instance and the flow Mat over the whole sequence, so that buffers are reused between frames
+    const int flags = options.gaussian ? (int)CustomOpticalFlowImpl::OPTFLOW_FARNEBACK_GAUSSIAN : 0;
+    Ptr<CustomOpticalFlowImpl> optflow = makePtr<CustomOpticalFlowImpl>(3, 0.5, false, 15, 3, 5, 1.2, flags);
+    //real-time mode, every frame gets the best quality tier that fits the budget
+    optflow->setFrameBudget(options.budget);
+    //the reports below only run in the sequential loop
+    if (pipeline)
+        return runPipeline(source, optflow, options);
     //initialise first frame
     Mat frame1, prvs;
-    capture >> frame1;
+    source.read(frame1);
     //convert into Grayscale picture
-    cvtColor(frame1, prvs, COLOR_BGR2GRAY);
-    //auto startLoop = chrono::high_resolution_clock::now();
-    while(true){
-        //initialize second frame
-        Mat frame2, next;
-        capture >> frame2;
-        //check if sequence ended
-        if (frame2.empty())
-            break;
-        //convert into Grayscale picture
-        cvtColor(frame2, next, COLOR_BGR2GRAY);
-        Mat flow(prvs.size(), CV_32FC2);
-        //auto start = chrono::steady_clock::now();
-        calcOpticalFlowFarneback(prvs, next, flow, 0.5, 3, 15, 3, 5, 1.2, 0);
-        //auto end = chrono::steady_clock::now();
-        // visualization
-        Mat flow_parts[2];
-        //split flow into multiple
-        split(flow, flow_parts);
-        Mat magnitude, angle, magn_norm;
-        //calculate magnitude and angles
-        cartToPolar(flow_parts[0], flow_parts[1], magnitude, angle, true);
-        normalize(magnitude, magn_norm, 0.0f, 1.0f, NORM_MINMAX);
-        angle *= ((1.f / 360.f) * (180.f / 255.f));
-
-        //build hsv image
-        Mat _hsv[3], hsv, hsv8, bgr;
-        _hsv[0] = angle;
-        _hsv[1] = Mat::ones(angle.size(), CV_32F);
-        _hsv[2] = magn_norm;
-        merge(_hsv, 3, hsv);
-        hsv.convertTo(hsv8, CV_8U, 255.0);
-        cvtColor(hsv8, bgr, COLOR_HSV2BGR);
-        imshow("frame2", bgr);
-        int keyboard = waitKey(30);
-        if (keyboard == 'q' || keyboard == 27)
-            break;
-        prvs = next;
-        //cout << "Overall Time to calculate: "<< chrono::duration_cast<chrono::duration<double, milli>>(end - start).count() << " ms" << endl;
+    toGray(frame1, prvs);
+    frame1.release();
+    Mat flow(prvs.size(), CV_32FC2);
+    //the first frame only fills the stream, every following frame is expanded once and paired with its predecessor
+    optflow->pushFrame(prvs, flow);
+#ifdef DENSEFLOW_REPORT_BATCH
+    //the whole sequence is run again through the batch API after the loop
+    vector<Mat> batchFrames(1, prvs.clone());
+#endif
+#ifdef DENSEFLOW_REPORT_BOX_FILTER
+    Mat boxFrame0 = prvs.clone(), boxFrame1;
+#endif
+#ifdef DENSEFLOW_REPORT_EPE
+    //the same stream with FP16 and bfloat16 storage of R and M, with the float box filter, with adaptive
+    //iterations, with motion gating, with warm start and on every lower quality tier of the frame budget,
+    //compared against the flow above; every variant and the reference are also timed per frame
+    struct Variant
+    {
+        string name;
+        int precision = CustomOpticalFlowImpl::STORAGE_FP32;
+        int boxMethod = CustomOpticalFlowImpl::BOX_DOUBLE;
+        bool adaptiveIters = false, motionGating = false, warmStart = false;
+        int tier = -1;
+    };
+    vector<Variant> variants(6);
+    variants[0].name = "FP16 storage";
+    variants[0].precision = CustomOpticalFlowImpl::STORAGE_FP16;
+    variants[1].name = "BF16 storage";
+    variants[1].precision = CustomOpticalFlowImpl::STORAGE_BF16;
+    variants[2].name = "float box filter";
+    variants[2].boxMethod = CustomOpticalFlowImpl::BOX_FLOAT_SIMD;
+    variants[3].name = "adaptive iterations";
+    variants[3].adaptiveIters = true;
+    variants[4].name = "motion gating";
+    variants[4].motionGating = true;
+    variants[5].name = "warm start";
+    variants[5].warmStart = true;
+    //tiers of 3 levels and 3 iterations: finest level 0-2 with 3, 2 and 1 iterations, then one coarse level less
+    for (int t = 1; t < 10; t++){
+        Variant v;
+        v.name = format("tier %d", t);
+        v.tier = t;
+        variants.push_back(v);
+    }
+    const int numVariants = (int)variants.size();
+    vector<Ptr<CustomOpticalFlowImpl> > variant(numVariants);
+    vector<Mat> variantFlow(numVariants);
+    vector<EndPointError> variantEpe(numVariants);
+    vector<double> variantMs(numVariants);
+    vector<int> variantIters(numVariants);
+    vector<FarnebackFrameTier> variantTier(numVariants);
+    double referenceMs = 0;
+    int referenceIters = 0;
+    int epeFrames = 0;
+    for (int i = 0; i < numVariants; i++){
+        variant[i] = makePtr<CustomOpticalFlowImpl>(3, 0.5, false, 15, 3, 5, 1.2, flags);
+        variant[i]->setStoragePrecision(variants[i].precision);
+        variant[i]->setBoxFilterMethod(variants[i].boxMethod);
+        variant[i]->setAdaptiveIterations(variants[i].adaptiveIters);
+        variant[i]->setMotionGating(variants[i].motionGating);
+        variant[i]->setWarmStart(variants[i].warmStart);
+        variant[i]->setFixedTier(variants[i].tier);
+        variantFlow[i].create(prvs.size(), CV_32FC2);
+        variant[i]->pushFrame(prvs, variantFlow[i]);
     }
-    //auto endLoop = chrono::high_resolution_clock::now();
-    //cout << chrono::duration_cast<chrono::duration<double, milli>>(endLoop - startLoop).count() << endl;
+#endif
+    FrameSink sink(options, source.fps());
+    FlowSink flowSink(options);
+    if (!flowSink.open())
+        return 1;
+    FrameTimes times(options.warmup);
+    TierTimes tiers(options.warmup);
+    FlowColouriser colourise;
+#ifdef FARNEBACK_TRACK_HEAP_ALLOCATIONS
+    //steady state: no frame pair after the first one and after the warm-up may allocate
+    FarnebackAllocStats steadyAllocs;
+    int pairs = 0, steadyFrames = 0, allocatingFrames = 0;
+#endif
+    bool quit = false;
+    for (int run = 0; run < options.repeat && !quit; run++){
+        if (run > 0){
+            //start the sequence over, its first frame must not be paired with the last one
+            Mat frame1;
+            if (!source.open() || !source.read(frame1))
+                break;
+            source.recycle(prvs);
+            toGray(frame1, prvs);
+            frame1.release();
+            optflow->resetStream();
+            optflow->pushFrame(prvs, flow);
+#ifdef DENSEFLOW_REPORT_EPE
+            for (int i = 0; i < numVariants; i++){
+                variant[i]->resetStream();
+                variant[i]->pushFrame(prvs, variantFlow[i]);
+            }
+#endif
+        }
+        while(true){
+            auto start = chrono::steady_clock::now();
+            //initialize second frame
+            Mat frame2, next;
+            //check if sequence ended
+            if (!source.read(frame2))
+                break;
+            //convert into Grayscale picture
+            toGray(frame2, next);
+            frame2.release();
+            auto flowStart = chrono::steady_clock::now();
+            flowSink.begin(next.size(), flow);
+            optflow->pushFrame(next, flow);
+            auto flowEnd = chrono::steady_clock::now();
+#ifdef FARNEBACK_TRACK_HEAP_ALLOCATIONS
+            if (++pairs > std::max(options.warmup, 1)){
+                FarnebackAllocStats allocs = optflow->getAllocStats();
+                for (int s = 0; s < FARNEBACK_STAGE_COUNT; s++)
+                    steadyAllocs.counts[s] += allocs.counts[s];
+                allocatingFrames += allocs.total() > 0;
+                steadyFrames++;
+            }
+#endif
+            if (options.budget > 0)
+                tiers.add(optflow->getFrameTier());
+#ifdef DENSEFLOW_REPORT_EPE
+            referenceMs += msBetween(flowStart, flowEnd);
+            referenceIters += optflow->getIterationStats().total();
+            for (int i = 0; i < numVariants; i++){
+                auto variantStart = chrono::steady_clock::now();
+                variant[i]->pushFrame(next, variantFlow[i]);
+                auto variantEnd = chrono::steady_clock::now();
+                variantMs[i] += chrono::duration_cast<chrono::duration<double, milli>>(variantEnd - variantStart).count();
+                variantIters[i] += variant[i]->getIterationStats().total();
+                variantTier[i] = variant[i]->getFrameTier();
+                variantEpe[i].add(variantFlow[i], flow);
+            }
+            epeFrames++;
+#endif
+#ifdef DENSEFLOW_REPORT_BATCH
+            if (run == 0)
+                batchFrames.push_back(next.clone());
+#endif
+#ifdef DENSEFLOW_REPORT_BOX_FILTER
+            if (boxFrame1.empty())
+                boxFrame1 = next.clone();
+#endif
+            // visualization
+            Mat bgr;
+            colourise(flow, bgr);
+            if (!sink.write(bgr) || !flowSink.end(flow))
+                return 1;
+            times.add(msBetween(start, chrono::steady_clock::now()), msBetween(flowStart, flowEnd));
+            if (!sink.next()){
+                quit = true;
+                break;
+            }
+            //the previous frame is no longer needed, its buffer takes a later frame
+            source.recycle(prvs);
+            prvs = next;
+        }
+    }
+    if (!flowSink.close())
+        return 1;
+#ifdef DENSEFLOW_REPORT_FLOW_FILE
+    if (!options.flow.empty() && options.flow.find('%') == string::npos)
+        reportFlowFile(options.flow);
+#endif
+    times.print(options.headless);
+    tiers.print(options.budget);
+#ifdef DENSEFLOW_REPORT_BOX_FILTER
+    if (!boxFrame1.empty())
+        reportBoxFilter(boxFrame0, boxFrame1);
+#endif
+#ifdef DENSEFLOW_REPORT_EPE
+    if (epeFrames > 0)
+        cout << "reference: " << referenceMs/epeFrames << " ms, " << (double)referenceIters/epeFrames
+             << " flow iterations per frame" << endl;
+    for (int i = 0; i < numVariants && epeFrames > 0; i++){
+        cout << variants[i].name;
+        if (variants[i].tier >= 0)
+            cout << " (levels " << variantTier[i].finest << "-" << variantTier[i].top << ", "
+                 << variantTier[i].iterations << " iterations)";
+        cout << ": EPE mean " << variantEpe[i].mean() << " px, p99 " << variantEpe[i].percentile(99)
+             << " px, p99.9 " << variantEpe[i].percentile(99.9) << " px, max " << variantEpe[i].maxErr << " px, " << variantMs[i]/epeFrames << " ms, " << (double)variantIters[i]/epeFrames
+             << " flow iterations per frame over " << epeFrames << " frames" << endl;
+    }
+#endif
+#ifdef DENSEFLOW_REPORT_BATCH
+    //throughput of the three kinds of parallelism, every pair is compared against the intra-frame run
+    const int batchModes[3] = { FARNEBACK_BATCH_INTRA, FARNEBACK_BATCH_FRAMES, FARNEBACK_BATCH_HYBRID };
+    const char* batchNames[3] = { "intra-frame", "frame-level", "hybrid" };
+    vector<Mat> intraFlows;
+    for (int i = 0; i < 3 && batchFrames.size() > 1; i++){
+        FarnebackBatchParams params;
+        params.parallelism = batchModes[i];
+        vector<Mat> batchFlows;
+        auto batchStart = chrono::steady_clock::now();
+        calcOpticalFlowFarnebackBatch(batchFrames, batchFlows, params);
+        double batchMs = chrono::duration_cast<chrono::duration<double, milli>>(chrono::steady_clock::now() - batchStart).count();
+        if (i == 0)
+            intraFlows = batchFlows;
+        EndPointError epe;
+        for (size_t k = 0; k < batchFlows.size(); k++)
+            epe.add(batchFlows[k], intraFlows[k]);
+        cout << "batch " << batchNames[i] << ": " << batchFlows.size()*1000.0/batchMs << " pairs/s, mean EPE "
+             << epe.mean() << " px, max EPE " << epe.maxErr << " px against intra-frame" << endl;
+    }
+#endif
+#ifdef FARNEBACK_TRACK_HEAP_ALLOCATIONS
+    const char* stageNames[FARNEBACK_STAGE_COUNT] = { "other", "pyramid", "polyExp", "UpdateMatrices", "UpdateFlow" };
+    cout << "heap allocations in " << steadyFrames << " steady-state frames:";
+    for (int s = 0; s < FARNEBACK_STAGE_COUNT; s++)
+        cout << " " << stageNames[s] << " " << steadyAllocs.counts[s];
+    cout << endl;
+    if (allocatingFrames > 0){
+        cerr << allocatingFrames << " of " << steadyFrames << " steady-state frames allocated" << endl;
+        return 1;
+    }
+#endif
 }
 
@@ -0,0 +1,1043 @@
+// Binary storage of dense optical flow.
+//
+// A flow file holds a sequence of CV_32FC2 flow fields in one memory-mapped container. All numbers are little
+// endian. The file starts with a 64 byte header:
+//
+//     0  char[8]  magic "DFLOWSEQ"
+//     8  uint32   version (2)
+//    12  uint32   record alignment in bytes, every frame record starts at a multiple of it
+//    16  int32    width of the first frame
+//    20  int32    height of the first frame
+//    24  uint64   number of frames in the index
+//    32  uint64   offset of the index, 0 while the file is being written
+//    40           reserved, 0
+//
+// Every frame is a record of a 64 byte record header followed by its payload:
+//
+//     0  char[4]  magic "FRME"
+//     4  uint32   encoding of the payload, FLOW_ENCODING_RAW or FLOW_ENCODING_COMPACT
+//     8  uint64   frame number
+//    16  int32    width
+//    20  int32    height
+//    24  uint64   bytes of the payload
+//    32  float    compact: quantisation step, the flow is the stored int16 values times it
+//    36  uint32   compact: tile size
+//    40  uint64   compact: frame number of the key frame the frame is predicted from
+//    48           reserved, 0
+//
+// A raw payload is rows of width*2 floats without padding. A compact payload starts with the uint32 offsets of
+// its tiles from the start of the payload, in row-major tile order, and the offset of the end of the last tile;
+// the tiles follow. Every tile is one mode byte (FLOW_TILE_SPATIAL or FLOW_TILE_TEMPORAL) and a bit stream,
+// see FlowEncodeTile.
+//
+// The index is an array of the uint64 record offsets of all frames, in frame order. The writer appends it
+// when it is closed; a file without an index (the writer did not finish) is read by walking the records.
+// Python src/flowFile.py reads the same files.
+//
+// Middlebury .flo files (one field per file) are written by writeFlo.
+
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <numeric>
+#include <chrono>
+#include <execution>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace cv
+{
+    enum { FLOW_FILE_HEADER_BYTES = 64, FLOW_RECORD_HEADER_BYTES = 64, FLOW_FILE_VERSION = 2 };
+    enum { FLOW_ENCODING_RAW = 0, FLOW_ENCODING_COMPACT = 1 };
+
+    struct FlowFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordAlign;
+        int32_t width;
+        int32_t height;
+        uint64_t frames;
+        uint64_t indexOffset;
+        uint8_t reserved[24];
+    };
+
+    struct FlowRecordHeader
+    {
+        char magic[4];
+        uint32_t encoding;
+        uint64_t frame;
+        int32_t width;
+        int32_t height;
+        uint64_t payloadBytes;
+        float step;
+        uint32_t tileSize;
+        uint64_t keyFrame;
+        uint8_t reserved[16];
+    };
+
+    static_assert(sizeof(FlowFileHeader) == FLOW_FILE_HEADER_BYTES, "flow file header layout");
+    static_assert(sizeof(FlowRecordHeader) == FLOW_RECORD_HEADER_BYTES, "flow record header layout");
+
+    // A file that is read or written through views of byte ranges. Views are independent mappings, so a view
+    // stays at its address while the file grows and other views come and go.
+    class MappedFile
+    {
+    public:
+        MappedFile() {}
+        ~MappedFile() { close(); }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // opens an existing file for reading, or creates (truncates) one for writing
+        bool open( const std::string& path, bool write )
+        {
+            close();
+            write_ = write;
+#if defined(_WIN32)
+            file_ = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                                write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if( file_ == INVALID_HANDLE_VALUE )
+                return false;
+            LARGE_INTEGER size;
+            GetFileSizeEx(file_, &size);
+            size_ = (uint64_t)size.QuadPart;
+#else
+            fd_ = ::open(path.c_str(), write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+            if( fd_ < 0 )
+                return false;
+            struct stat st;
+            fstat(fd_, &st);
+            size_ = (uint64_t)st.st_size;
+#endif
+            return true;
+        }
+
+        bool isOpened() const
+        {
+#if defined(_WIN32)
+            return file_ != INVALID_HANDLE_VALUE;
+#else
+            return fd_ >= 0;
+#endif
+        }
+
+        uint64_t size() const { return size_; }
+
+        // grows (or, with no views left, shrinks) the file to bytes. Growing reserves the disk space, so a full
+        // disk fails here and not when a view is written.
+        bool resize( uint64_t bytes )
+        {
+#if defined(_WIN32)
+            LARGE_INTEGER pos;
+            pos.QuadPart = (LONGLONG)bytes;
+            if( !SetFilePointerEx(file_, pos, NULL, FILE_BEGIN) || !SetEndOfFile(file_) )
+                return false;
+#else
+#if defined(__linux__)
+            if( bytes > size_ )
+            {
+                int err = posix_fallocate(fd_, (off_t)size_, (off_t)(bytes - size_));
+                if( err != 0 && err != EINVAL && err != EOPNOTSUPP )
+                    return false;
+            }
+#endif
+            if( ftruncate(fd_, (off_t)bytes) != 0 )
+                return false;
+#endif
+            size_ = bytes;
+            return true;
+        }
+
+        // view of [offset, offset + length), offset a multiple of granularity(); 0 on failure
+        uchar* map( uint64_t offset, size_t length )
+        {
+#if defined(_WIN32)
+            uint64_t end = offset + length;
+            HANDLE mapping = CreateFileMappingA(file_, NULL, write_ ? PAGE_READWRITE : PAGE_READONLY,
+                                                (DWORD)(end >> 32), (DWORD)end, NULL);
+            if( !mapping )
+                return 0;
+            void* data = MapViewOfFile(mapping, write_ ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(offset >> 32),
+                                       (DWORD)offset, length);
+            // the view keeps the mapping alive
+            CloseHandle(mapping);
+            return (uchar*)data;
+#else
+            int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+            // a new frame is written whole, faulting its pages in at once is cheaper than one by one
+            if( write_ )
+                flags |= MAP_POPULATE;
+#endif
+            void* data = mmap(0, length, write_ ? PROT_READ | PROT_WRITE : PROT_READ, flags, fd_, (off_t)offset);
+            return data == MAP_FAILED ? 0 : (uchar*)data;
+#endif
+        }
+
+        static void unmap( uchar* data, size_t length )
+        {
+#if defined(_WIN32)
+            (void)length;
+            UnmapViewOfFile(data);
+#else
+            munmap(data, length);
+#endif
+        }
+
+        // alignment of view offsets
+        static size_t granularity()
+        {
+#if defined(_WIN32)
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return info.dwAllocationGranularity;
+#else
+            return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+        }
+
+        void close()
+        {
+#if defined(_WIN32)
+            if( file_ != INVALID_HANDLE_VALUE )
+                CloseHandle(file_);
+            file_ = INVALID_HANDLE_VALUE;
+#else
+            if( fd_ >= 0 )
+                ::close(fd_);
+            fd_ = -1;
+#endif
+            size_ = 0;
+        }
+
+    private:
+#if defined(_WIN32)
+        HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+        int fd_ = -1;
+#endif
+        uint64_t size_ = 0;
+        bool write_ = false;
+    };
+
+    static inline uint64_t
+    FlowAlignUp( uint64_t x, uint64_t align )
+    {
+        return (x + align - 1)/align*align;
+    }
+
+    // Compact frames. The flow is quantised to int16 multiples of a per-frame step and cut into square tiles
+    // that are coded independently of each other. A tile of a key frame predicts every value from its left,
+    // upper and upper-left neighbours in the tile (the median predictor of LOCO-I); a tile of any other frame
+    // either does the same or predicts from the same tile of the previous frame, whichever leaves the smaller
+    // residuals. Residuals are Rice coded with parameters that follow their running mean, and a run of pixels
+    // without residual in either channel is coded as its length.
+    enum { FLOW_TILE_SPATIAL = 0, FLOW_TILE_TEMPORAL = 1 };
+    // longest unary part of a Rice code, larger values follow it as 32 plain bits
+    enum { FLOW_RICE_LIMIT = 24 };
+
+    // appends bits to a byte vector, least significant bit first
+    class FlowBitWriter
+    {
+    public:
+        explicit FlowBitWriter( std::vector<uchar>& out ) : out_(out) {}
+
+        // the low bits (at most 32) of value
+        void put( uint32_t value, int bits )
+        {
+            bits_ |= (uint64_t)value << count_;
+            count_ += bits;
+            for( ; count_ >= 8; count_ -= 8, bits_ >>= 8 )
+                out_.push_back((uchar)bits_);
+        }
+
+        void flush()
+        {
+            if( count_ > 0 )
+                out_.push_back((uchar)bits_);
+            bits_ = 0;
+            count_ = 0;
+        }
+
+    private:
+        std::vector<uchar>& out_;
+        uint64_t bits_ = 0;
+        int count_ = 0;
+    };
+
+    // reads what FlowBitWriter wrote, zeros past the end
+    class FlowBitReader
+    {
+    public:
+        FlowBitReader( const uchar* p, const uchar* end ) : p_(p), end_(end) {}
+
+        uint32_t get( int bits )
+        {
+            if( bits == 0 )
+                return 0;
+            refill(bits);
+            uint32_t value = (uint32_t)(bits_ & (((uint64_t)1 << bits) - 1));
+            bits_ >>= bits;
+            count_ -= bits;
+            return value;
+        }
+
+        uint32_t getRice( int k )
+        {
+            refill(FLOW_RICE_LIMIT);
+            int q = 0;
+            for( ; q < FLOW_RICE_LIMIT && (bits_ & 1); q++ )
+                bits_ >>= 1;
+            count_ -= q;
+            if( q == FLOW_RICE_LIMIT )
+                return get(32);
+            bits_ >>= 1;
+            count_--;
+            return ((uint32_t)q << k) | get(k);
+        }
+
+    private:
+        void refill( int bits )
+        {
+            for( ; count_ < bits; count_ += 8 )
+                bits_ |= (uint64_t)(p_ < end_ ? *p_++ : 0) << count_;
+        }
+
+        const uchar* p_;
+        const uchar* end_;
+        uint64_t bits_ = 0;
+        int count_ = 0;
+    };
+
+    static inline void
+    FlowPutRice( FlowBitWriter& w, uint32_t u, int k )
+    {
+        uint32_t q = u >> k;
+        if( q < FLOW_RICE_LIMIT )
+        {
+            // q ones and a zero, then the low k bits
+            w.put((1u << q) - 1, q + 1);
+            w.put(u & ((1u << k) - 1), k);
+        }
+        else
+        {
+            w.put((1u << FLOW_RICE_LIMIT) - 1, FLOW_RICE_LIMIT);
+            w.put(u, 32);
+        }
+    }
+
+    // running mean of the coded values, gives the Rice parameter of the next one
+    struct FlowRiceStats
+    {
+        uint32_t sum = 4, count = 1;
+
+        int k() const
+        {
+            int k = 0;
+            while( (count << k) < sum && k < FLOW_RICE_LIMIT )
+                k++;
+            return k;
+        }
+
+        void update( uint32_t u )
+        {
+            sum += u;
+            if( ++count == 64 )
+            {
+                sum >>= 1;
+                count >>= 1;
+            }
+        }
+    };
+
+    static inline uint32_t FlowZigZag( int r ) { return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31); }
+    static inline int FlowUnZigZag( uint32_t u ) { return (int)(u >> 1) ^ -(int)(u & 1); }
+
+    // prediction of row[x] (x counts interleaved values) from its neighbours in the tile; up is the row above,
+    // 0 in the first row of the tile
+    static inline int
+    FlowPredict( const short* row, const short* up, int x )
+    {
+        if( !up )
+            return x >= 2 ? row[x-2] : 0;
+        if( x < 2 )
+            return up[x];
+        int a = row[x-2], b = up[x], c = up[x-2];
+        int mx = std::max(a, b), mn = std::min(a, b);
+        return c >= mx ? mn : c <= mn ? mx : a + b - c;
+    }
+
+    // quantises the tile of flow into q, false if a value does not fit int16 at this step
+    static bool
+    FlowQuantiseTile( const Mat& flow, Mat& q, const Rect& tile, float step, float& maxError )
+    {
+        float scale = 1.f/step;
+        bool fits = true;
+        for( int y = 0; y < tile.height; y++ )
+        {
+            const float* f = flow.ptr<float>(tile.y + y) + tile.x*2;
+            short* d = q.ptr<short>(tile.y + y) + tile.x*2;
+            for( int x = 0; x < tile.width*2; x++ )
+            {
+                float v = f[x]*scale;
+                if( !(std::abs(v) <= 32767.f) )
+                {
+                    fits = false;
+                    v = 0;
+                }
+                d[x] = (short)cvRound(v);
+                maxError = std::max(maxError, std::abs(f[x] - d[x]*step));
+            }
+        }
+        return fits;
+    }
+
+    static void
+    FlowEncodeResiduals( const uint32_t* u, int n, std::vector<uchar>& out )
+    {
+        FlowBitWriter w(out);
+        FlowRiceStats stats[2], runs;
+        // a tile starts with a run, a pixel without residual starts the next one
+        bool run = true;
+        for( int i = 0; i < n; i++ )
+        {
+            if( run )
+            {
+                int len = 0;
+                while( i + len < n && (u[(i+len)*2] | u[(i+len)*2+1]) == 0 )
+                    len++;
+                FlowPutRice(w, len, runs.k());
+                runs.update(len);
+                i += len;
+                if( i == n )
+                    break;
+            }
+            for( int c = 0; c < 2; c++ )
+            {
+                FlowPutRice(w, u[i*2+c], stats[c].k());
+                stats[c].update(u[i*2+c]);
+            }
+            run = (u[i*2] | u[i*2+1]) == 0;
+        }
+        w.flush();
+    }
+
+    // codes the tile of q into out, predicted from the same tile of prev unless prev is empty
+    static void
+    FlowEncodeTile( const Mat& q, const Mat& prev, const Rect& tile, std::vector<uchar>& out )
+    {
+        int n = tile.area();
+        thread_local std::vector<uint32_t> spatial, temporal;
+        spatial.resize(n*2);
+        temporal.resize(n*2);
+        uint64_t spatialSum = 0, temporalSum = 0;
+        for( int y = 0, i = 0; y < tile.height; y++ )
+        {
+            const short* row = q.ptr<short>(tile.y + y) + tile.x*2;
+            const short* up = y > 0 ? q.ptr<short>(tile.y + y - 1) + tile.x*2 : 0;
+            const short* last = prev.empty() ? 0 : prev.ptr<short>(tile.y + y) + tile.x*2;
+            for( int x = 0; x < tile.width*2; x++, i++ )
+            {
+                spatial[i] = FlowZigZag(row[x] - FlowPredict(row, up, x));
+                spatialSum += spatial[i];
+                if( last )
+                {
+                    temporal[i] = FlowZigZag(row[x] - last[x]);
+                    temporalSum += temporal[i];
+                }
+            }
+        }
+        bool useTemporal = !prev.empty() && temporalSum < spatialSum;
+        out.clear();
+        out.push_back(useTemporal ? FLOW_TILE_TEMPORAL : FLOW_TILE_SPATIAL);
+        FlowEncodeResiduals(useTemporal ? temporal.data() : spatial.data(), n, out);
+    }
+
+    // decodes a tile coded by FlowEncodeTile into q, which holds the same tile of the previous frame if the
+    // tile is temporal
+    static void
+    FlowDecodeTile( const uchar* data, const uchar* end, Mat& q, const Rect& tile )
+    {
+        bool temporal = data < end && *data == FLOW_TILE_TEMPORAL;
+        FlowBitReader r(data + 1, end);
+        FlowRiceStats stats[2], runs;
+        bool run = true;
+        int zeros = 0;
+        for( int y = 0; y < tile.height; y++ )
+        {
+            short* row = q.ptr<short>(tile.y + y) + tile.x*2;
+            const short* up = y > 0 ? q.ptr<short>(tile.y + y - 1) + tile.x*2 : 0;
+            for( int x = 0; x < tile.width*2; x += 2 )
+            {
+                if( run )
+                {
+                    zeros = (int)r.getRice(runs.k());
+                    runs.update(zeros);
+                    run = false;
+                }
+                uint32_t u[2] = { 0, 0 };
+                if( zeros > 0 )
+                    zeros--;
+                else
+                {
+                    for( int c = 0; c < 2; c++ )
+                    {
+                        u[c] = r.getRice(stats[c].k());
+                        stats[c].update(u[c]);
+                    }
+                    run = (u[0] | u[1]) == 0;
+                }
+                for( int c = 0; c < 2; c++ )
+                    row[x+c] = (short)((temporal ? row[x+c] : FlowPredict(row, up, x + c)) + FlowUnZigZag(u[c]));
+            }
+        }
+    }
+
+    // how a FlowFileWriter stores frames
+    struct FlowFileParams
+    {
+        // quantisation step in pixels of compact frames, 0 stores raw CV_32FC2 frames
+        double step = 0;
+        // compact frames are coded in independent tiles of tileSize x tileSize pixels
+        int tileSize = 64;
+        // every keyInterval-th compact frame is coded on its own, the frames after it are predicted from their
+        // predecessor; reading any frame decodes back to its key frame
+        int keyInterval = 30;
+    };
+
+    // what a FlowFileWriter has written so far
+    struct FlowFileStats
+    {
+        int frames = 0;
+        // bytes of the flow as CV_32FC2 and of the records written for it
+        double rawBytes = 0, fileBytes = 0;
+        double encodeMs = 0;
+        // largest difference between the flow and its compact frames, in pixels
+        double maxError = 0;
+    };
+
+    // Writes a flow file. A raw frame gets a view of its record in the file and the flow is computed straight
+    // into it, so no frame is copied; beginFrame and commitFrame may be called from different threads. Compact
+    // frames are encoded by writeFrame, in parallel over their tiles, and must be written in order. Frames are
+    // numbered in the order beginFrame or writeFrame is called.
+    class FlowFileWriter
+    {
+    public:
+        ~FlowFileWriter() { close(); }
+
+        bool open( const std::string& path, const FlowFileParams& params = FlowFileParams() )
+        {
+            close();
+            if( !file_.open(path, true) )
+                return false;
+            params_ = params;
+            align_ = std::max(MappedFile::granularity(), (size_t)FLOW_FILE_HEADER_BYTES);
+            end_ = align_;
+            frames_.clear();
+            stats_ = FlowFileStats();
+            prev_.release();
+            prevStep_ = 0;
+            sinceKey_ = 0;
+            if( !file_.resize(end_) )
+            {
+                file_.close();
+                return false;
+            }
+            return writeHeader(0, 0);
+        }
+
+        bool isOpened() const { return file_.isOpened(); }
+
+        bool isCompact() const { return params_.step > 0; }
+
+        FlowFileStats getStats() const { return stats_; }
+
+        // CV_32FC2 Mat over the payload of the next raw frame, empty if the file cannot grow or is compact. It
+        // stays valid until the frame is committed.
+        Mat beginFrame( Size size )
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if( !file_.isOpened() || isCompact() )
+                return Mat();
+            FlowRecordHeader header = {};
+            header.encoding = FLOW_ENCODING_RAW;
+            header.width = size.width;
+            header.height = size.height;
+            header.payloadBytes = (uint64_t)size.width*size.height*2*sizeof(float);
+            uint64_t offset;
+            uchar* data = appendRecord(header, offset);
+            if( !data )
+                return Mat();
+            uchar* flow = data + FLOW_RECORD_HEADER_BYTES;
+            views_[flow] = View{ data, FLOW_RECORD_HEADER_BYTES + (size_t)header.payloadBytes, frames_.size() };
+            frames_.push_back(Frame{ offset, false });
+            stats_.frames++;
+            stats_.rawBytes += (double)header.payloadBytes;
+            stats_.fileBytes += FLOW_RECORD_HEADER_BYTES + (double)header.payloadBytes;
+            return Mat(size, CV_32FC2, flow);
+        }
+
+        // writes flow (CV_32FC2) as the next frame, copied into a raw frame or encoded as a compact one
+        bool writeFrame( const Mat& flow )
+        {
+            CV_Assert( flow.type() == CV_32FC2 );
+            if( !isCompact() )
+            {
+                Mat view = beginFrame(flow.size());
+                if( view.empty() )
+                    return false;
+                flow.copyTo(view);
+                return commitFrame(view);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if( !file_.isOpened() )
+                return false;
+            auto start = std::chrono::steady_clock::now();
+            int ts = std::max(params_.tileSize, 1);
+            int tilesX = (flow.cols + ts - 1)/ts, tilesY = (flow.rows + ts - 1)/ts, ntiles = tilesX*tilesY;
+            std::vector<int> order(ntiles);
+            std::iota(order.begin(), order.end(), 0);
+            tiles_.resize(ntiles);
+            std::vector<float> errors(ntiles);
+            q_.create(flow.size(), CV_16SC2);
+
+            // the step grows for a frame whose flow does not fit int16; a frame with another step or size than
+            // its predecessor cannot be predicted from it
+            float step = (float)params_.step;
+            bool key = prev_.size() != flow.size() || sinceKey_ >= params_.keyInterval || step != prevStep_;
+            for( int pass = 0; pass < 2; pass++ )
+            {
+                std::atomic<bool> fits(true);
+                std::for_each(std::execution::par, order.begin(), order.end(), [&](int t){
+                    Rect tile = Rect(t % tilesX*ts, t/tilesX*ts, ts, ts) & Rect(0, 0, flow.cols, flow.rows);
+                    errors[t] = 0;
+                    bool tileFits = FlowQuantiseTile(flow, q_, tile, step, errors[t]);
+                    if( !tileFits )
+                        fits = false;
+                    // the second pass keeps what still does not fit (not a number) as 0
+                    if( tileFits || pass == 1 )
+                        FlowEncodeTile(q_, key ? Mat() : prev_, tile, tiles_[t]);
+                });
+                if( fits )
+                    break;
+                step = std::max(step, (float)(norm(flow, NORM_INF)/32767*1.0001));
+                key = true;
+            }
+
+            std::vector<uint32_t> offsets(ntiles + 1);
+            offsets[0] = (uint32_t)((ntiles + 1)*sizeof(uint32_t));
+            for( int t = 0; t < ntiles; t++ )
+                offsets[t+1] = offsets[t] + (uint32_t)tiles_[t].size();
+            FlowRecordHeader header = {};
+            header.encoding = FLOW_ENCODING_COMPACT;
+            header.width = flow.cols;
+            header.height = flow.rows;
+            header.payloadBytes = offsets[ntiles];
+            header.step = step;
+            header.tileSize = ts;
+            header.keyFrame = key ? frames_.size() : keyFrame_;
+            uint64_t offset;
+            uchar* data = appendRecord(header, offset);
+            if( !data )
+                return false;
+            uchar* payload = data + FLOW_RECORD_HEADER_BYTES;
+            std::memcpy(payload, offsets.data(), offsets[0]);
+            for( int t = 0; t < ntiles; t++ )
+                std::memcpy(payload + offsets[t], tiles_[t].data(), tiles_[t].size());
+            MappedFile::unmap(data, FLOW_RECORD_HEADER_BYTES + (size_t)header.payloadBytes);
+
+            keyFrame_ = header.keyFrame;
+            sinceKey_ = key ? 1 : sinceKey_ + 1;
+            prevStep_ = step;
+            std::swap(q_, prev_);
+            frames_.push_back(Frame{ offset, true });
+            stats_.frames++;
+            stats_.rawBytes += (double)flow.total()*flow.elemSize();
+            stats_.fileBytes += FLOW_RECORD_HEADER_BYTES + (double)header.payloadBytes;
+            stats_.encodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            stats_.maxError = std::max(stats_.maxError, (double)*std::max_element(errors.begin(), errors.end()));
+            return true;
+        }
+
+        // the flow in a Mat from beginFrame is final; releases the Mat. False if flow is not a view of this
+        // file, e.g. an empty Mat from a failed beginFrame that the flow was allocated into.
+        bool commitFrame( Mat& flow )
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = views_.find(flow.data);
+            flow.release();
+            if( it == views_.end() )
+                return false;
+            frames_[it->second.frame].committed = true;
+            MappedFile::unmap(it->second.data, it->second.length);
+            views_.erase(it);
+            return true;
+        }
+
+        // appends the index of the committed frames and completes the header; views of frames that were not
+        // committed become invalid and the frames are left out
+        bool close()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if( !file_.isOpened() )
+                return true;
+            for( auto& view : views_ )
+                MappedFile::unmap(view.second.data, view.second.length);
+            views_.clear();
+
+            std::vector<uint64_t> index;
+            for( const Frame& frame : frames_ )
+                if( frame.committed )
+                    index.push_back(frame.offset);
+            uint64_t indexOffset = end_;
+            size_t indexBytes = index.size()*sizeof(uint64_t);
+            bool ok = file_.resize(indexOffset + indexBytes);
+            if( ok && indexBytes > 0 )
+            {
+                // the index starts at a view boundary, so map it together with nothing else
+                uchar* data = file_.map(indexOffset, indexBytes);
+                ok = data != 0;
+                if( ok )
+                {
+                    std::memcpy(data, index.data(), indexBytes);
+                    MappedFile::unmap(data, indexBytes);
+                }
+            }
+            ok = ok && writeHeader(width_, height_, index.size(), indexOffset);
+            file_.close();
+            return ok;
+        }
+
+    private:
+        struct View
+        {
+            uchar* data;
+            size_t length;
+            size_t frame;
+        };
+
+        struct Frame
+        {
+            uint64_t offset;
+            bool committed;
+        };
+
+        // maps a new record for header, fills in its magic and frame number and writes it; 0 if the file
+        // cannot grow
+        uchar* appendRecord( FlowRecordHeader& header, uint64_t& offset )
+        {
+            if( frames_.empty() && !writeHeader(header.width, header.height) )
+                return 0;
+            size_t length = FLOW_RECORD_HEADER_BYTES + (size_t)header.payloadBytes;
+            offset = end_;
+            if( !file_.resize(offset + FlowAlignUp(length, align_)) )
+                return 0;
+            uchar* data = file_.map(offset, length);
+            if( !data )
+                return 0;
+            end_ = file_.size();
+            std::memcpy(header.magic, "FRME", 4);
+            header.frame = frames_.size();
+            std::memcpy(data, &header, sizeof(header));
+            return data;
+        }
+
+        bool writeHeader( int width, int height, uint64_t frames = 0, uint64_t indexOffset = 0 )
+        {
+            uchar* data = file_.map(0, FLOW_FILE_HEADER_BYTES);
+            if( !data )
+                return false;
+            FlowFileHeader header = {};
+            std::memcpy(header.magic, "DFLOWSEQ", 8);
+            header.version = FLOW_FILE_VERSION;
+            header.recordAlign = (uint32_t)align_;
+            header.width = width_ = width;
+            header.height = height_ = height;
+            header.frames = frames;
+            header.indexOffset = indexOffset;
+            std::memcpy(data, &header, sizeof(header));
+            MappedFile::unmap(data, FLOW_FILE_HEADER_BYTES);
+            return true;
+        }
+
+        MappedFile file_;
+        std::mutex mutex_;
+        FlowFileParams params_;
+        FlowFileStats stats_;
+        size_t align_ = 0;
+        uint64_t end_ = 0;
+        int width_ = 0, height_ = 0;
+        std::vector<Frame> frames_;
+        std::map<uchar*, View> views_;
+        // compact frames: the quantised flow of this frame and of the previous one, the encoded tiles
+        Mat q_, prev_;
+        float prevStep_ = 0;
+        uint64_t keyFrame_ = 0;
+        int sinceKey_ = 0;
+        std::vector<std::vector<uchar> > tiles_;
+    };
+
+    // Reads a flow file through one read-only view of the whole file. Any frame is found through the index
+    // without touching the frames before it; a compact frame is decoded from its key frame on, but only in the
+    // tiles that are read.
+    class FlowFileReader
+    {
+    public:
+        ~FlowFileReader() { close(); }
+
+        bool open( const std::string& path )
+        {
+            close();
+            if( !file_.open(path, false) || file_.size() < FLOW_FILE_HEADER_BYTES )
+                return false;
+            size_ = (size_t)file_.size();
+            data_ = file_.map(0, size_);
+            if( !data_ )
+                return false;
+            FlowFileHeader header;
+            std::memcpy(&header, data_, sizeof(header));
+            if( std::memcmp(header.magic, "DFLOWSEQ", 8) != 0 || header.version != FLOW_FILE_VERSION ||
+                header.recordAlign == 0 )
+            {
+                close();
+                return false;
+            }
+            if( header.indexOffset != 0 && header.indexOffset <= size_ &&
+                header.frames <= (size_ - header.indexOffset)/sizeof(uint64_t) )
+            {
+                index_.resize((size_t)header.frames);
+                std::memcpy(index_.data(), data_ + header.indexOffset, index_.size()*sizeof(uint64_t));
+                // every record and its payload lie within the file
+                for( uint64_t offset : index_ )
+                {
+                    FlowRecordHeader record;
+                    if( offset > size_ - FLOW_RECORD_HEADER_BYTES )
+                    {
+                        close();
+                        return false;
+                    }
+                    std::memcpy(&record, data_ + offset, sizeof(record));
+                    if( record.payloadBytes > size_ - FLOW_RECORD_HEADER_BYTES - offset )
+                    {
+                        close();
+                        return false;
+                    }
+                }
+            }
+            else
+            {
+                // the writer did not finish, every record it allocated is still there, the last ones maybe
+                // not completely written
+                for( uint64_t offset = header.recordAlign; offset + FLOW_RECORD_HEADER_BYTES <= size_; )
+                {
+                    FlowRecordHeader record;
+                    std::memcpy(&record, data_ + offset, sizeof(record));
+                    if( std::memcmp(record.magic, "FRME", 4) != 0 ||
+                        record.payloadBytes > size_ - FLOW_RECORD_HEADER_BYTES - offset )
+                        break;
+                    index_.push_back(offset);
+                    offset += FlowAlignUp(FLOW_RECORD_HEADER_BYTES + record.payloadBytes, header.recordAlign);
+                }
+            }
+            checked_.assign(index_.size(), 0);
+            return true;
+        }
+
+        bool isOpened() const { return data_ != 0; }
+
+        int frames() const { return (int)index_.size(); }
+
+        // flow of frame n as a CV_32FC2 Mat over the file, valid while the reader is open; empty if the frame
+        // is not raw flow or its payload is too small for it
+        Mat frame( int n ) const
+        {
+            CV_Assert( 0 <= n && n < frames() );
+            FlowRecordHeader record = recordHeader(n);
+            if( record.encoding != FLOW_ENCODING_RAW || record.width <= 0 || record.height <= 0 ||
+                (uint64_t)record.width*record.height*sizeof(float)*2 > record.payloadBytes )
+                return Mat();
+            return Mat(record.height, record.width, CV_32FC2, data_ + index_[n] + FLOW_RECORD_HEADER_BYTES);
+        }
+
+        // Flow of frame n, or of the part of it in region, as a CV_32FC2 Mat of the region's size. A compact
+        // frame decodes the tiles under region, each one together with the same tile of the frames before it
+        // as far back as it is temporal, unless the previous read left it decoded (reading frames in order
+        // decodes every frame once). False if region misses the frame, the encoding is unknown or a frame it
+        // decodes from is damaged (see compactValid).
+        bool read( int n, Mat& flow, Rect region = Rect() )
+        {
+            CV_Assert( 0 <= n && n < frames() );
+            FlowRecordHeader record = recordHeader(n);
+            Size size(record.width, record.height);
+            region = region.empty() ? Rect(Point(), size) : region & Rect(Point(), size);
+            if( region.empty() )
+                return false;
+            if( record.encoding == FLOW_ENCODING_RAW )
+            {
+                Mat raw = frame(n);
+                if( raw.empty() )
+                    return false;
+                raw(region).copyTo(flow);
+                return true;
+            }
+            // the frames back to the key frame all have to be intact compact frames of the same tiling
+            if( !compactValid(n) || record.keyFrame > record.frame || record.frame - record.keyFrame > (uint64_t)n )
+                return false;
+            int key = n - (int)(record.frame - record.keyFrame);
+            for( int f = key; f < n; f++ )
+            {
+                FlowRecordHeader fr = recordHeader(f);
+                if( !compactValid(f) || fr.width != record.width || fr.height != record.height ||
+                    fr.tileSize != record.tileSize )
+                    return false;
+            }
+
+            int ts = (int)record.tileSize, tilesX = (size.width + ts - 1)/ts;
+            std::vector<int> tiles;
+            for( int ty = region.y/ts; ty <= (region.br().y - 1)/ts; ty++ )
+                for( int tx = region.x/ts; tx <= (region.br().x - 1)/ts; tx++ )
+                    tiles.push_back(ty*tilesX + tx);
+            if( q_.size() != size || qTileSize_ != ts )
+            {
+                q_.create(size, CV_16SC2);
+                qTileSize_ = ts;
+                qFrame_ = -1;
+                decoded_.assign((size_t)tilesX*((size.height + ts - 1)/ts), 0);
+            }
+            // a tile decodes from the last frame in which it is spatial, or from where the previous read left it
+            int first = n + 1;
+            std::vector<int> start(tiles.size());
+            for( size_t i = 0; i < tiles.size(); i++ )
+            {
+                int t = tiles[i], f = n + 1;
+                if( !decoded_[t] || qFrame_ != n )
+                    for( f = n; f > key && !(decoded_[t] && f - 1 == qFrame_) &&
+                                tileMode(f, t) == FLOW_TILE_TEMPORAL; f-- )
+                        ;
+                start[i] = f;
+                first = std::min(first, start[i]);
+            }
+            // tiles that are not read fall behind
+            if( first <= n )
+                std::fill(decoded_.begin(), decoded_.end(), 0);
+            std::vector<int> due;
+            for( int f = first; f <= n; f++ )
+            {
+                due.clear();
+                for( size_t i = 0; i < tiles.size(); i++ )
+                    if( start[i] <= f )
+                        due.push_back(tiles[i]);
+                const uchar* payload = data_ + index_[f] + FLOW_RECORD_HEADER_BYTES;
+                const uint32_t* offsets = (const uint32_t*)payload;
+                std::for_each(std::execution::par, due.begin(), due.end(), [&](int t){
+                    Rect tile = Rect(t % tilesX*ts, t/tilesX*ts, ts, ts) & Rect(Point(), size);
+                    FlowDecodeTile(payload + offsets[t], payload + offsets[t+1], q_, tile);
+                });
+            }
+            for( int t : tiles )
+                decoded_[t] = 1;
+            qFrame_ = n;
+            q_(region).convertTo(flow, CV_32F, record.step);
+            return true;
+        }
+
+        void close()
+        {
+            if( data_ )
+                MappedFile::unmap(data_, size_);
+            data_ = 0;
+            size_ = 0;
+            index_.clear();
+            checked_.clear();
+            file_.close();
+            q_.release();
+            qFrame_ = -1;
+            qTileSize_ = 0;
+        }
+
+    private:
+        FlowRecordHeader recordHeader( int n ) const
+        {
+            FlowRecordHeader record;
+            std::memcpy(&record, data_ + index_[n], sizeof(record));
+            return record;
+        }
+
+        // Whether frame n is a compact frame whose tile offset table and tiles lie within its payload, every
+        // tile holding at least its mode byte. Checked once per frame.
+        bool compactValid( int n )
+        {
+            if( checked_[n] == 0 )
+            {
+                FlowRecordHeader record = recordHeader(n);
+                bool valid = record.encoding == FLOW_ENCODING_COMPACT && record.tileSize > 0 &&
+                             record.width > 0 && record.height > 0;
+                uint64_t ts = record.tileSize, tiles = 0;
+                if( valid )
+                {
+                    tiles = ((uint64_t)record.width + ts - 1)/ts*(((uint64_t)record.height + ts - 1)/ts);
+                    valid = (tiles + 1)*sizeof(uint32_t) <= record.payloadBytes;
+                }
+                if( valid )
+                {
+                    const uint32_t* offsets = (const uint32_t*)(data_ + index_[n] + FLOW_RECORD_HEADER_BYTES);
+                    valid = offsets[0] >= (tiles + 1)*sizeof(uint32_t) && offsets[tiles] <= record.payloadBytes;
+                    for( uint64_t t = 0; valid && t < tiles; t++ )
+                        valid = offsets[t] < offsets[t+1];
+                }
+                checked_[n] = valid ? 1 : 2;
+            }
+            return checked_[n] == 1;
+        }
+
+        // mode of tile t of frame n, which has to be compactValid
+        int tileMode( int n, int t ) const
+        {
+            const uchar* payload = data_ + index_[n] + FLOW_RECORD_HEADER_BYTES;
+            return payload[((const uint32_t*)payload)[t]];
+        }
+
+        MappedFile file_;
+        uchar* data_ = 0;
+        size_t size_ = 0;
+        std::vector<uint64_t> index_;
+        // per frame whether compactValid has found it valid (1) or not (2), 0 before it is checked
+        std::vector<uchar> checked_;
+        // compact frames: the quantised flow of frame qFrame_, decoded in the tiles marked in decoded_
+        Mat q_;
+        int qFrame_ = -1, qTileSize_ = 0;
+        std::vector<uchar> decoded_;
+    };
+
+    // writes flow (CV_32FC2) as a Middlebury .flo file
+    static bool
+    writeFlo( const std::string& path, const Mat& flow )
+    {
+        CV_Assert( flow.type() == CV_32FC2 );
+        FILE* f = std::fopen(path.c_str(), "wb");
+        if( !f )
+            return false;
+        const float tag = 202021.25f;
+        int32_t size[2] = { flow.cols, flow.rows };
+        bool ok = std::fwrite(&tag, sizeof(tag), 1, f) == 1 && std::fwrite(size, sizeof(size), 1, f) == 1;
+        for( int y = 0; ok && y < flow.rows; y++ )
+            ok = std::fwrite(flow.ptr<float>(y), sizeof(float)*2, flow.cols, f) == (size_t)flow.cols;
+        return std::fclose(f) == 0 && ok;
+    }
+} // namespace cv